@@ -0,0 +1,79 @@
+// 通过 LD_PRELOAD 统计进程的内存分配次数，退出时把结果追加写到
+// $SAW_ALLOC_COUNT_FILE，格式为 "<pid> <count>\n"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+namespace {
+
+std::atomic<uint64_t> alloc_cnt{0};
+
+__attribute__((destructor)) void DumpAllocCount() {
+  const char *path = getenv("SAW_ALLOC_COUNT_FILE");
+  if (path == nullptr) {
+    return;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    return;
+  }
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%d %lu\n", getpid(),
+                     static_cast<unsigned long>(alloc_cnt.load()));
+  if (write(fd, line, len) != len) {
+    perror("write alloc count");
+  }
+  close(fd);
+}
+
+} // namespace
+
+extern "C" {
+
+void *malloc(size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  void *ptr = __libc_memalign(alignment, size);
+  if (ptr == nullptr) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+} // extern "C"
@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+"""在 soft-RoCE (rdma_rxe) 回环上跑 saw_server/saw_client，和基线比较。
+
+rxe 的绝对带宽没有意义，所以比较的是消息速率、每条消息的 CPU 时间和
+内存分配次数。rxe 的结果受机器负载影响，每个用例跑多次，取中位数和基线
+比较。server 的地址和两端的 gid_index 默认取 rxe 设备上第一个 IPv4 的
+RoCE v2 GID。设备不存在、或者还没有记录基线时以 77 退出，ctest 会把用例
+标记为 skipped；基线用 --update-baseline 记录。
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP = 77
+SYSFS_IB = "/sys/class/infiniband"
+IPV4_GID_PREFIX = "0000:0000:0000:0000:0000:ffff:"
+# recover 用例在发送到这个 task 时把 client 的 QP 强制转换为 Error 状态
+RECOVER_INJECT_TASK = 100000
+CLIENT_RE = re.compile(r"messages: (\d+) in (\d+) us, cpu (\d+) us")
+SERVER_RE = re.compile(r"messages: (\d+), cpu (\d+) us")
+RESUMED_RE = re.compile(r"traffic resumed (\d+) us after qp error")
+
+
+def find_ipv4_gid(device):
+    """返回 device 上第一个 IPv4 RoCE v2 GID 的 (gid_index, ip)，没有时返回 None。"""
+    port_dir = os.path.join(SYSFS_IB, device, "ports", "1")
+    gids_dir = os.path.join(port_dir, "gids")
+    for name in sorted(os.listdir(gids_dir), key=int):
+        with open(os.path.join(gids_dir, name)) as f:
+            gid = f.read().strip()
+        if not gid.startswith(IPV4_GID_PREFIX):
+            continue
+        try:
+            with open(os.path.join(port_dir, "gid_attrs", "types", name)) as f:
+                gid_type = f.read().strip()
+        except OSError:
+            # 空的表项读 type 会返回 EINVAL
+            continue
+        if gid_type != "RoCE v2":
+            continue
+        hi, lo = (int(x, 16) for x in gid[len(IPV4_GID_PREFIX):].split(":"))
+        ip = ".".join(str(b) for b in (hi >> 8, hi & 0xff, lo >> 8, lo & 0xff))
+        return int(name), ip
+    return None
+
+
+def wait_proc(proc, timeout):
+    """等进程退出，返回 exit code。"""
+    try:
+        return proc.wait(timeout=timeout)
+    except subprocess.TimeoutExpired:
+        raise TimeoutError(f"{proc.args[0]} timed out")
+
+
+def run_pair(args, workdir):
+    """启动 server，等它开始监听后跑 client，返回两端的输出和资源占用。"""
+    env = dict(os.environ)
+    env["RDMA_GID_INDEX"] = str(args.gid_index)
+    alloc_file = os.path.join(workdir, "alloc_count.txt")
+    if args.alloc_lib:
+        env["LD_PRELOAD"] = args.alloc_lib
+        env["SAW_ALLOC_COUNT_FILE"] = alloc_file
+
+    server_log = os.path.join(workdir, "server.log")
+    server_cmd = [args.server, args.device, str(args.port)]
+    with open(server_log, "w") as log:
+        server = subprocess.Popen(server_cmd, stdout=log,
+                                  stderr=subprocess.STDOUT, env=env)
+
+    deadline = time.time() + 10
+    while True:
+        with open(server_log) as log:
+            if "server start listening" in log.read():
+                break
+        if server.poll() is not None or time.time() > deadline:
+            server.kill()
+            with open(server_log) as log:
+                sys.stderr.write(log.read())
+            raise RuntimeError("saw_server failed to start")
+        time.sleep(0.05)
+
+    client_log = os.path.join(workdir, "client.log")
+    client_cmd = [args.client, args.device, args.server_ip, str(args.port)]
+    if args.case == "recover":
+        client_cmd.append(str(RECOVER_INJECT_TASK))
+    with open(client_log, "w") as log:
+        client = subprocess.Popen(client_cmd, stdout=log,
+                                  stderr=subprocess.STDOUT, env=env)
+    # 任何一端出错退出时另一端可能一直等下去，超时后都杀掉，日志照常返回
+    timed_out = None
+    try:
+        client_rc = wait_proc(client, args.timeout)
+        server_rc = wait_proc(server, 30)
+    except TimeoutError as e:
+        timed_out = str(e)
+        client.kill()
+        server.kill()
+        client_rc = client.wait()
+        server_rc = server.wait()
+
+    with open(client_log) as log:
+        client_out = log.read()
+    with open(server_log) as log:
+        server_out = log.read()
+    allocs = {}
+    if os.path.exists(alloc_file):
+        with open(alloc_file) as f:
+            for line in f:
+                pid, cnt = line.split()
+                allocs[int(pid)] = int(cnt)
+
+    return {
+        "timed_out": timed_out,
+        "client_out": client_out,
+        "client_rc": client_rc,
+        "client_allocs": allocs.get(client.pid),
+        "server_out": server_out,
+        "server_rc": server_rc,
+        "server_allocs": allocs.get(server.pid),
+    }
+
+
+def collect_metrics(args, run):
+    # CPU 时间由两端自己统计，只覆盖从 ExchangeQP 到传输结束这一段
+    m = CLIENT_RE.search(run["client_out"])
+    if m is None:
+        raise RuntimeError("no messages line in saw_client output")
+    msgs, elapsed_us, client_cpu_us = (int(g) for g in m.groups())
+    m = SERVER_RE.search(run["server_out"])
+    if m is None:
+        raise RuntimeError("no messages line in saw_server output")
+    server_msgs, server_cpu_us = (int(g) for g in m.groups())
+    if server_msgs != msgs:
+        raise RuntimeError(f"server got {server_msgs} messages, "
+                           f"client sent {msgs}")
+    # 续传起点错了 server 会打印 expect chunk 并退出，这里再兜底检查一次
+    if "expect chunk" in run["server_out"]:
+        raise RuntimeError("saw_server received chunks out of order")
+
+    metrics = {
+        "msg_rate": msgs * 1e6 / elapsed_us,
+        "client_cpu_us_per_msg": client_cpu_us / msgs,
+        "server_cpu_us_per_msg": server_cpu_us / msgs,
+    }
+    if run["client_allocs"] is not None:
+        metrics["client_allocs"] = run["client_allocs"]
+    if run["server_allocs"] is not None:
+        metrics["server_allocs"] = run["server_allocs"]
+    if args.case == "recover":
+        m = RESUMED_RE.search(run["client_out"])
+        if m is None:
+            raise RuntimeError("saw_client did not report qp recovery")
+        metrics["recovery_us"] = int(m.group(1))
+    return metrics
+
+
+def median_metrics(samples):
+    """每个指标取各次运行的中位数。"""
+    names = set().union(*samples)
+    return {name: statistics.median(s[name] for s in samples if name in s)
+            for name in names}
+
+
+def compare(metrics, baseline):
+    """返回 (超出容忍范围或者这次没有测到的指标, 没有基线值的指标)。"""
+    failures = []
+    missing = []
+    for name, value in sorted(metrics.items()):
+        spec = baseline.get(name)
+        if spec is None or spec.get("value") is None:
+            print(f"  {name:24} {value:14.3f}  NO BASELINE")
+            missing.append(name)
+            continue
+        base = spec["value"]
+        tol = spec["tolerance"]
+        if spec["better"] == "higher":
+            limit = base * (1 - tol)
+            ok = value >= limit
+        else:
+            limit = base * (1 + tol)
+            ok = value <= limit
+        print(f"  {name:24} {value:14.3f}  baseline {base:.3f} "
+              f"limit {limit:.3f}  {'ok' if ok else 'REGRESSION'}")
+        if not ok:
+            failures.append(name)
+    for name, spec in sorted(baseline.items()):
+        if name not in metrics and spec.get("value") is not None:
+            print(f"  {name:24} {'':14}  MISSING")
+            failures.append(name)
+    return failures, missing
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--server", required=True)
+    parser.add_argument("--client", required=True)
+    parser.add_argument("--alloc-lib", default="")
+    parser.add_argument("--device", default="rxe0")
+    parser.add_argument("--port", type=int, default=7897)
+    parser.add_argument("--server-ip", default="",
+                        help="默认取设备上 IPv4 RoCE v2 GID 对应的地址")
+    parser.add_argument("--gid-index", type=int, default=-1,
+                        help="两端使用的 gid_index，默认和 --server-ip 一起探测")
+    parser.add_argument("--case", choices=["send", "recover"],
+                        default="send")
+    parser.add_argument("--baseline", required=True)
+    parser.add_argument("--output", required=True)
+    parser.add_argument("--timeout", type=int, default=500)
+    parser.add_argument("--iterations", type=int, default=5,
+                        help="每个用例跑几次，取中位数比较")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="把这次的结果写成新的基线")
+    args = parser.parse_args()
+
+    if not os.path.isdir(os.path.join(SYSFS_IB, args.device)):
+        print(f"rdma device {args.device} not found, skip. create one on an "
+              f"ethernet netdev with an IPv4 address: "
+              f"rdma link add {args.device} type rxe netdev <netdev>")
+        return SKIP
+    if not args.server_ip or args.gid_index < 0:
+        found = find_ipv4_gid(args.device)
+        if found is None:
+            print(f"no IPv4 RoCE v2 GID on {args.device}, give --server-ip "
+                  f"and --gid-index explicitly")
+            return 1
+        args.gid_index = found[0] if args.gid_index < 0 else args.gid_index
+        args.server_ip = args.server_ip or found[1]
+    print(f"server {args.server_ip}:{args.port}, gid_index {args.gid_index}")
+
+    samples = []
+    for i in range(args.iterations):
+        with tempfile.TemporaryDirectory() as workdir:
+            try:
+                run = run_pair(args, workdir)
+            except RuntimeError as e:
+                print(f"iteration {i}: {e}")
+                return 1
+        try:
+            if run["timed_out"]:
+                raise RuntimeError(run["timed_out"])
+            if run["client_rc"] != 0 or run["server_rc"] != 0:
+                raise RuntimeError(f"client exit {run['client_rc']}, "
+                                   f"server exit {run['server_rc']}")
+            samples.append(collect_metrics(args, run))
+        except RuntimeError as e:
+            print(f"iteration {i}: {e}")
+            print("---- saw_client output ----\n" + run["client_out"])
+            print("---- saw_server output ----\n" + run["server_out"])
+            return 1
+
+    metrics = median_metrics(samples)
+    with open(args.output, "w") as f:
+        json.dump({"case": args.case, "device": args.device,
+                   "metrics": metrics, "samples": samples}, f, indent=2)
+
+    with open(args.baseline) as f:
+        baselines = json.load(f)
+    baseline = baselines.setdefault(args.case, {})
+    print(f"case {args.case} on {args.device}, "
+          f"median of {args.iterations} runs:")
+    failures, missing = compare(metrics, baseline)
+
+    if args.update_baseline:
+        for name, value in metrics.items():
+            baseline.setdefault(name, {})["value"] = value
+        with open(args.baseline, "w") as f:
+            json.dump(baselines, f, indent=2)
+            f.write("\n")
+        print(f"baseline {args.baseline} updated")
+        return 0
+    if failures:
+        print(f"FAILED: {', '.join(failures)}")
+        return 1
+    if missing:
+        print(f"SKIPPED: no baseline for {', '.join(missing)}. rerun with "
+              f"--update-baseline on a quiet machine and commit "
+              f"{args.baseline}")
+        return SKIP
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
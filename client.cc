@@ -8,16 +8,21 @@
 #include <json/value.h>
 #include <jsonrpccpp/client.h>
 #include <jsonrpccpp/client/connectors/tcpsocketclient.h>
+#include <jsonrpccpp/common/exception.h>
 #include <jsonrpccpp/common/procedure.h>
 #include <jsonrpccpp/common/specification.h>
 #include <malloc.h>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 using std::cerr;
 using std::endl;
 using std::string;
 
+// 连续恢复超过这个次数说明错误一直存在，不再重试
+constexpr int kMaxRecoverCnt = 3;
+
 struct ClientContext {
   int link_type; // IBV_LINK_LAYER_XX
   RdmaDeviceInfo dev_info;
@@ -25,8 +30,11 @@ struct ClientContext {
   ibv_mr *mr; // 只是创建删除时候使用
   ibv_cq *cq;
   ibv_qp *qp;
+  RdmaQpExchangeInfo local_info;
+  RdmaQpExchangeInfo remote_info;
   char *ip;
   int port;
+  bool server_done; // server 已经确认按顺序收全了所有 chunk
 
   void BuildRdmaEnvironment(const string &dev_name) {
     // 1. dev_info and pd
@@ -59,6 +67,7 @@ struct ClientContext {
       exit(0);
     }
     qp = nullptr;
+    server_done = false;
   }
 
   void DestroyRdmaEnvironment() {
@@ -84,12 +93,13 @@ void ExchangeQP() { // NOLINT
     cerr << "create qp failed" << endl;
     exit(0);
   }
-  RdmaQpExchangeInfo local_info;
+  RdmaQpExchangeInfo &local_info = c_ctx.local_info;
   local_info.lid = c_ctx.dev_info.port_attr.lid;
   local_info.qpNum = c_ctx.qp->qp_num;
-  ibv_query_gid(c_ctx.dev_info.ctx, kRdmaDefaultPort, kGidIndex,
+  local_info.gid_index = RdmaGetGidIndex();
+  ibv_query_gid(c_ctx.dev_info.ctx, kRdmaDefaultPort, local_info.gid_index,
                 &local_info.gid);
-  local_info.gid_index = kGidIndex;
+  local_info.psn = RdmaGenPsn();
   printf("local lid %d qp_num %d gid %s gid_index %d\n", local_info.lid,
          local_info.qpNum, RdmaGid2Str(local_info.gid).c_str(),
          local_info.gid_index);
@@ -98,82 +108,205 @@ void ExchangeQP() { // NOLINT
   req["qp_num"] = local_info.qpNum;
   req["gid"] = RdmaGid2Str(local_info.gid);
   req["gid_index"] = local_info.gid_index;
+  req["psn"] = local_info.psn;
 
   jsonrpc::TcpSocketClient client(c_ctx.ip, c_ctx.port);
   jsonrpc::Client c(client);
   Json::Value resp = c.CallMethod("ExchangeQP", req);
 
-  RdmaQpExchangeInfo remote_info;
+  RdmaQpExchangeInfo &remote_info = c_ctx.remote_info;
   remote_info.lid = static_cast<uint16_t>(resp["lid"].asUInt());
   remote_info.qpNum = resp["qp_num"].asUInt();
   remote_info.gid = RdmaStr2Gid(resp["gid"].asString());
   remote_info.gid_index = resp["gid_index"].asInt();
+  remote_info.psn = resp["psn"].asUInt();
   printf("remote lid %d qp_num %d gid %s gid_index %d\n", local_info.lid,
          local_info.qpNum, RdmaGid2Str(local_info.gid).c_str(),
          local_info.gid_index);
 
-  RdmaModifyQp2Rts(c_ctx.qp, local_info, remote_info);
+  if (RdmaModifyQp2Rts(c_ctx.qp, local_info, remote_info) != 0) {
+    cerr << "setup qp failed" << endl;
+    exit(1);
+  }
 }
 
 ibv_wc wc[kPollCqSize];
 
+// 取一批发送完成事件，每个 CQE 对应一个 WR，不论成功与否都不再 onflight；
+// 只有成功的才算对端确认。出现错误 CQE 时返回 false
+bool PollSendCq(size_t &onflight_tasks, size_t &acked_tasks) {
+  int n = ibv_poll_cq(c_ctx.cq, kPollCqSize, wc);
+  if (n < 0) {
+    fprintf(stderr, "ERROR: poll cq failed %d\n", n);
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    onflight_tasks--;
+    if (wc[i].status == IBV_WC_SUCCESS) {
+      if (wc[i].opcode == IBV_WC_SEND) {
+        acked_tasks++;
+      } else {
+        fprintf(stderr, "ERROR: wc[i] opcode %d\n", wc[i].opcode);
+      }
+    } else {
+      if (ok) {
+        fprintf(stderr, "ERROR: wc[i] status %s\n",
+                ibv_wc_status_str(wc[i].status));
+      }
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// 调用 server 的 method，RPC 本身失败时直接退出
+Json::Value CallServer(const string &method, const Json::Value &req) {
+  try {
+    jsonrpc::TcpSocketClient client(c_ctx.ip, c_ctx.port);
+    jsonrpc::Client c(client);
+    return c.CallMethod(method, req);
+  } catch (jsonrpc::JsonRpcException &e) {
+    cerr << "call " << method << " failed: " << e.what() << endl;
+    exit(1);
+  }
+}
+
+// QP 出错后调用：把还没完成的 WR 全部刷出，QP 经 RESET 重新到 RTS，
+// 和 server 交换新的 PSN，返回双方都确认过的续传起点。
+// 返回值不小于 kSendTaskNum 时说明 server 已经确认收全，不再恢复 QP
+size_t RecoverQP(size_t &onflight_tasks, size_t &acked_tasks) { // NOLINT
+  if (RdmaModifyQp2Error(c_ctx.qp) != 0) {
+    cerr << "modify qp to error failed" << endl;
+    exit(1);
+  }
+  auto deadline = std::chrono::high_resolution_clock::now() +
+                  std::chrono::microseconds(kDrainTimeoutUs);
+  while (onflight_tasks > 0) {
+    PollSendCq(onflight_tasks, acked_tasks);
+    if (std::chrono::high_resolution_clock::now() > deadline) {
+      cerr << "drain cq timeout, " << onflight_tasks << " sends left" << endl;
+      exit(1);
+    }
+  }
+
+  c_ctx.local_info.psn = RdmaGenPsn();
+  Json::Value req;
+  req["psn"] = c_ctx.local_info.psn;
+  req["acked"] = static_cast<Json::UInt64>(acked_tasks);
+  Json::Value resp = CallServer("RecoverQP", req);
+  if (!resp["ok"].asBool()) {
+    cerr << "server recover qp failed" << endl;
+    exit(1);
+  }
+  // server 按顺序收到的 chunk 数不会少于本端确认的数量
+  size_t resume_task = resp["recv_cnt"].asUInt64();
+  acked_tasks = resume_task;
+  if (resume_task >= kSendTaskNum) {
+    c_ctx.server_done = true;
+    return resume_task;
+  }
+
+  c_ctx.remote_info.psn = resp["psn"].asUInt();
+  if (RdmaRecoverQp(c_ctx.qp, c_ctx.local_info, c_ctx.remote_info) != 0) {
+    cerr << "recover qp failed" << endl;
+    exit(1);
+  }
+  return resume_task;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    printf("Usage: %s <dev_name> <server_ip> <server_port>\n", argv[0]);
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s <dev_name> <server_ip> <server_port> "
+           "[inject_error_at_task]\n",
+           argv[0]);
     return 0;
   }
   string dev_name = argv[1];
   c_ctx.ip = argv[2];
   c_ctx.port = atoi(argv[3]);
+  // 发送到这个 task 时把 QP 强制转换为 Error 状态，用来测试恢复
+  size_t inject_error_task = argc == 5 ? strtoull(argv[4], nullptr, 10) : 0;
 
+  srand48(getpid());
   c_ctx.BuildRdmaEnvironment(dev_name);
 
+  int64_t start_cpu_us = GetProcessCpuUs();
   ExchangeQP();
   auto start_time = std::chrono::high_resolution_clock::now();
   size_t onflight_tasks = 0;
-  for (size_t task = 0; task < kSendTaskNum; task++) {
-    while (onflight_tasks >= kTransmitLimit) {
-      int n = ibv_poll_cq(c_ctx.cq, kPollCqSize, wc);
-      onflight_tasks -= n;
-      for (int i = 0; i < n; i++) {
-        if (wc[i].status == IBV_WC_SUCCESS) {
-          if (wc[i].opcode == IBV_WC_SEND) {
-            ;
-          } else {
-            fprintf(stderr, "ERROR: wc[i] opcode %d", wc[i].opcode);
-          }
-        } else {
-          fprintf(stderr, "ERROR: wc[i] status %d", wc[i].status);
-        }
+  size_t acked_tasks = 0;
+  size_t task = 0;
+  bool qp_ok = true;
+  int recover_cnt = 0;
+  auto error_time = start_time;
+  bool resuming = false; // 恢复后还没有收到第一个成功的发送完成
+  while (acked_tasks < kSendTaskNum) {
+    if (!qp_ok) {
+      if (recover_cnt >= kMaxRecoverCnt) {
+        cerr << "qp still failing after " << recover_cnt << " recoveries"
+             << endl;
+        exit(1);
       }
+      error_time = std::chrono::high_resolution_clock::now();
+      task = RecoverQP(onflight_tasks, acked_tasks);
+      auto rebuilt_time = std::chrono::high_resolution_clock::now();
+      printf("qp recovered in %ld us, resume from task %zu\n",
+             std::chrono::duration_cast<std::chrono::microseconds>(
+                 rebuilt_time - error_time)
+                 .count(),
+             task);
+      recover_cnt++;
+      resuming = true;
+      qp_ok = true;
+      continue;
     }
-    RdmaPostSend(kBufferSize, c_ctx.mr->lkey, task, task, c_ctx.qp,
-                 c_ctx.buf + (task % kTransmitLimit) * kBufferSize);
-    onflight_tasks++;
-  }
-
-  while (onflight_tasks > 0) {
-    int n = ibv_poll_cq(c_ctx.cq, kPollCqSize, wc);
-    onflight_tasks -= n;
-    for (int i = 0; i < n; i++) {
-      if (wc[i].status == IBV_WC_SUCCESS) {
-        if (wc[i].opcode == IBV_WC_SEND) {
-          ;
-        } else {
-          fprintf(stderr, "ERROR: wc[i] opcode %d", wc[i].opcode);
-        }
-      } else {
-        fprintf(stderr, "ERROR: wc[i] status %d", wc[i].status);
+    if (task < kSendTaskNum && onflight_tasks < kTransmitLimit) {
+      if (argc == 5 && task == inject_error_task && recover_cnt == 0) {
+        RdmaModifyQp2Error(c_ctx.qp);
       }
+      if (RdmaPostSend(kBufferSize, c_ctx.mr->lkey, task, task, c_ctx.qp,
+                       c_ctx.buf + (task % kTransmitLimit) * kBufferSize) !=
+          0) {
+        fprintf(stderr, "ERROR: post send task %zu failed\n", task);
+        qp_ok = false;
+        continue;
+      }
+      task++;
+      onflight_tasks++;
+      continue;
+    }
+    size_t acked_before = acked_tasks;
+    qp_ok = PollSendCq(onflight_tasks, acked_tasks);
+    if (resuming && acked_tasks > acked_before) {
+      auto resumed_time = std::chrono::high_resolution_clock::now();
+      printf("traffic resumed %ld us after qp error\n",
+             std::chrono::duration_cast<std::chrono::microseconds>(
+                 resumed_time - error_time)
+                 .count());
+      resuming = false;
     }
   }
   auto end_time = std::chrono::high_resolution_clock::now();
+  int64_t cpu_us = GetProcessCpuUs() - start_cpu_us;
+  // 发送完成只说明数据到了对端，还要 server 确认按顺序收全了
+  if (!c_ctx.server_done) {
+    Json::Value resp = CallServer("FinishQP", Json::Value());
+    if (!resp["ok"].asBool()) {
+      cerr << "server got " << resp["recv_cnt"].asUInt() << " chunks in order"
+           << endl;
+      exit(1);
+    }
+  }
   c_ctx.DestroyRdmaEnvironment();
   auto duration_in_us = std::chrono::duration_cast<std::chrono::microseconds>(
       end_time - start_time);
   printf("\nbandwidth: %.3f MB/s, with %.3f KiB per send, total %.3f GiB in %.3fs\n",
          kSendTaskNum * kBufferSize * 1.0 / duration_in_us.count(), kBufferSize / 1024.0,
          kSendTaskNum * kBufferSize / 1024.0 / 1024.0 / 1024.0, duration_in_us.count()/1000.0/1000.0);
+  // 精确的消息数和耗时，bench/run_bench.py 解析这一行
+  printf("messages: %zu in %ld us, cpu %ld us\n", kSendTaskNum,
+         duration_in_us.count(), cpu_us);
 
   return 0;
 }
\ No newline at end of file
@@ -1,8 +1,10 @@
 #include "rdma.h"
 #include <arpa/inet.h>
+#include <cstdlib>
 #include <cstring>
 #include <infiniband/verbs.h>
 #include <string>
+#include <sys/resource.h>
 #include <vector>
 
 using std::string;
@@ -18,6 +20,14 @@ string RdmaGid2Str(ibv_gid gid) {
   return res;
 }
 
+int RdmaGetGidIndex() {
+  const char *env = getenv("RDMA_GID_INDEX");
+  if (env == nullptr || env[0] == '\0') {
+    return kGidIndex;
+  }
+  return atoi(env);
+}
+
 char get_xdigit(char ch) {
   if (ch >= '0' && ch <= '9')
     return ch - '0';
@@ -51,23 +61,36 @@ vector<RdmaDeviceInfo> RdmaGetRdmaDeviceInfoByNames(const vector<string> &names,
   if (dev_list == nullptr) {
     return {};
   }
+  // 出错时释放已经打开的设备和设备列表
+  auto fail = [&](ibv_context *ctx) -> vector<RdmaDeviceInfo> {
+    if (ctx != nullptr) {
+      ibv_close_device(ctx);
+    }
+    for (auto &info : ans) {
+      ibv_dealloc_pd(info.pd);
+      ibv_close_device(info.ctx);
+    }
+    ibv_free_device_list(dev_list);
+    return {};
+  };
+
   for (const auto &name : names) {
     RdmaDeviceInfo info;
 
-    // open device
+    // open device，设备列表以 nullptr 结尾
     ibv_device **dev = dev_list;
-    while (dev != nullptr &&
+    while (*dev != nullptr &&
            strcmp(ibv_get_device_name(*dev), name.c_str()) != 0) {
       dev++;
     }
-    if (dev == nullptr) {
-      printf("device %s not found", name.c_str());
-      return {};
+    if (*dev == nullptr) {
+      printf("device %s not found\n", name.c_str());
+      return fail(nullptr);
     }
     info.ctx = ibv_open_device(*dev);
     if (info.ctx == nullptr) {
-      printf("open %s failed", name.c_str());
-      return {};
+      printf("open %s failed\n", name.c_str());
+      return fail(nullptr);
     }
 
     // get dev_attr
@@ -77,20 +100,20 @@ vector<RdmaDeviceInfo> RdmaGetRdmaDeviceInfoByNames(const vector<string> &names,
     ibv_query_port(info.ctx, kRdmaDefaultPort, &info.port_attr);
     if (info.port_attr.link_layer == IBV_LINK_LAYER_UNSPECIFIED) {
       link_type = IBV_LINK_LAYER_UNSPECIFIED;
-      return {};
+      return fail(info.ctx);
     }
     if (link_type != IBV_LINK_LAYER_UNSPECIFIED &&
         info.port_attr.link_layer != link_type) {
       link_type = info.port_attr.link_layer;
-      return {};
+      return fail(info.ctx);
     }
     link_type = info.port_attr.link_layer;
 
     // allocate pd
     info.pd = ibv_alloc_pd(info.ctx);
-    if (info.ctx == nullptr) {
-      printf("allocate pd for %s failed", name.c_str());
-      return {};
+    if (info.pd == nullptr) {
+      printf("allocate pd for %s failed\n", name.c_str());
+      return fail(info.ctx);
     }
 
     ans.push_back(info);
@@ -122,6 +145,8 @@ ibv_qp *RdmaCreateQp(ibv_pd *pd, ibv_cq *send_cq, ibv_cq *recv_cq,
   return ibv_create_qp(pd, &qp_init_attr);
 }
 
+uint32_t RdmaGenPsn() { return lrand48() & 0xffffff; }
+
 int RdmaModifyQp2Reset(struct ibv_qp *qp) {
   int ret = 0;
 
@@ -139,6 +164,23 @@ int RdmaModifyQp2Reset(struct ibv_qp *qp) {
   return ret;
 }
 
+int RdmaModifyQp2Error(struct ibv_qp *qp) {
+  int ret = 0;
+
+  // change QP state to ERR
+  {
+    struct ibv_qp_attr qp_attr;
+    memset(&qp_attr, 0, sizeof(ibv_qp_attr));
+    qp_attr.qp_state = IBV_QPS_ERR;
+
+    ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
+    if (ret != 0) {
+      printf("ibv_modify_qp to ERR failed %d\n", ret);
+    }
+  }
+  return ret;
+}
+
 int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
                      RdmaQpExchangeInfo &remote) {
   int ret = 0;
@@ -160,6 +202,7 @@ int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
                             IBV_QP_ACCESS_FLAGS);
     if (ret != 0) {
       printf("ibv_modify_qp to INIT failed %d", ret);
+      return ret;
     }
   }
 
@@ -170,7 +213,7 @@ int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
 
     qp_attr.qp_state = IBV_QPS_RTR;
     qp_attr.path_mtu = IBV_MTU_1024;
-    qp_attr.rq_psn = 0;
+    qp_attr.rq_psn = remote.psn;
     qp_attr.dest_qp_num = remote.qpNum;
     qp_attr.max_dest_rd_atomic = 1;
     qp_attr.min_rnr_timer = 12;
@@ -196,6 +239,7 @@ int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
     if (ret != 0) {
       printf("ibv_modify_qp to RTR failed %d %d %s", ret, errno,
              strerror(errno));
+      return ret;
     }
   }
 
@@ -204,7 +248,7 @@ int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
     struct ibv_qp_attr qp_attr;
     memset(&qp_attr, 0, sizeof(ibv_qp_attr));
     qp_attr.qp_state = IBV_QPS_RTS;
-    qp_attr.sq_psn = 0;
+    qp_attr.sq_psn = local.psn;
     qp_attr.max_rd_atomic = 1;
     qp_attr.timeout = 14;
     qp_attr.retry_cnt = 7;
@@ -216,12 +260,29 @@ int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
                             IBV_QP_MAX_QP_RD_ATOMIC);
     if (ret != 0) {
       printf("ibv_modify_qp to RTS failed %d %d", ret, errno);
+      return ret;
     }
   }
 
   return 0;
 }
 
+int RdmaRecoverQp(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
+                  RdmaQpExchangeInfo &remote) {
+  int ret = RdmaModifyQp2Reset(qp);
+  if (ret != 0) {
+    return ret;
+  }
+  return RdmaModifyQp2Rts(qp, local, remote);
+}
+
+int64_t GetProcessCpuUs() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
 int RdmaPostSend(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
                  uint32_t imm_data, ibv_qp *qp, const void *buf) {
   int ret = 0;
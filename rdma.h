@@ -23,6 +23,7 @@ struct RdmaQpExchangeInfo {
   uint32_t qpNum;
   union ibv_gid gid;
   int gid_index;
+  uint32_t psn; // 起始 PSN，每次（重新）建立连接都重新生成
 };
 
 constexpr int kRdmaDefaultPort = 1; // 查询设备信息时使用的默认端口号
@@ -33,7 +34,9 @@ constexpr int kTransmitLimit = 128;
 constexpr int kPollCqSize = 16;
 // WQ、CQ 的大小
 constexpr int kRdmaQueueSize = 1024;
-constexpr int kGidIndex = 0; // magic
+constexpr int kGidIndex = 0; // magic，可以用环境变量 RDMA_GID_INDEX 覆盖
+// QP 出错后等待未完成的 WR 全部刷出的最长时间
+constexpr int64_t kDrainTimeoutUs = 1000000;
 
 // 通过网卡名称获取 RdmaDeviceInfo
 std::vector<RdmaDeviceInfo>
@@ -44,19 +47,36 @@ RdmaGetRdmaDeviceInfoByNames(const std::vector<std::string> &names,
 ibv_qp *RdmaCreateQp(ibv_pd *pd, ibv_cq *send_cq, ibv_cq *recv_cq,
                      uint32_t qe_size, ibv_qp_type qp_type);
 
+// 本端使用的 gid_index，设置了 RDMA_GID_INDEX 时用它，否则用 kGidIndex
+int RdmaGetGidIndex();
+
 // 将 gid 转换为便于传输的 string
 std::string RdmaGid2Str(ibv_gid gid);
 
 // 将收到的 string 转换为 gid
 ibv_gid RdmaStr2Gid(std::string s);
 
+// 生成一个随机的 24 位 PSN
+uint32_t RdmaGenPsn();
+
 // 把 QP 转换为 Reset 状态
 int RdmaModifyQp2Reset(struct ibv_qp *qp);
 
-// 把 QP 转换为 RTS 状态
+// 把 QP 转换为 Error 状态，未完成的 WR 全部以 IBV_WC_WR_FLUSH_ERR 刷出
+int RdmaModifyQp2Error(struct ibv_qp *qp);
+
+// 把 QP 转换为 RTS 状态，sq_psn 用 local.psn，rq_psn 用 remote.psn
 int RdmaModifyQp2Rts(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
                      RdmaQpExchangeInfo &remote);
 
+// 复用原有的 MR、CQ，把 QP 经 RESET 重新转换为 RTS 状态
+// 调用前需要先把 CQ 中属于这个 QP 的 CQE 取干净
+int RdmaRecoverQp(struct ibv_qp *qp, RdmaQpExchangeInfo &local,
+                  RdmaQpExchangeInfo &remote);
+
+// 当前进程所有线程累计的用户态 + 内核态 CPU 时间
+int64_t GetProcessCpuUs();
+
 int RdmaPostSend(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
                  uint32_t imm_data, ibv_qp *qp, const void *buf);
 int RdmaPostRecv(uint32_t req_size, uint32_t lkey, uint64_t wr_id, ibv_qp *qp,
@@ -1,4 +1,7 @@
 #include "rdma.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <infiniband/verbs.h>
@@ -8,8 +11,10 @@
 #include <jsonrpccpp/server.h>
 #include <jsonrpccpp/server/connectors/tcpsocketserver.h>
 #include <malloc.h>
+#include <mutex>
 #include <string>
 #include <sys/time.h>
+#include <unistd.h>
 #include <vector>
 
 using jsonrpc::JSON_STRING;
@@ -20,6 +25,8 @@ using std::endl;
 using std::string;
 
 constexpr int64_t kShowInterval = 2000000;
+// 收完之后等待 client 确认结果的最长时间
+constexpr int64_t kFinishTimeoutUs = 10000000;
 
 struct ServerContext {
   int link_type; // IBV_LINK_LAYER_XX
@@ -28,6 +35,78 @@ struct ServerContext {
   ibv_mr *mr; // 只是创建删除时候使用
   ibv_cq *cq;
   ibv_qp *qp;
+  RdmaQpExchangeInfo local_info;
+  RdmaQpExchangeInfo remote_info;
+  // 以下字段只在主循环线程里访问，jrpc 线程在 qp_ready 之前或者等待
+  // recover_requested 清零期间才会读写
+  int recv_cnt;     // 按顺序收到的 chunk 数，也是恢复时续传的起点
+  int posted_recvs; // 已 post 成功但还没有取到 CQE 的 recv WR 数
+  bool qp_broken;   // 取到过错误 CQE，等待 client 发起恢复
+  bool chunk_lost;  // 收到的 chunk 和 recv_cnt 对不上，续传起点已经不可信
+  int64_t start_cpu_us; // ExchangeQP 时的进程 CPU 时间
+  // jrpc 线程设置，主循环每轮检查一次，不在轮询路径上加锁
+  std::atomic<bool> qp_ready;
+  std::atomic<bool> recover_requested;
+  // 以下字段由 mu 保护，主循环处理完恢复或退出时通过 cv 通知 jrpc 线程
+  std::mutex mu;
+  std::condition_variable cv;
+  bool recover_ok;
+  bool finished;    // 主循环已经退出，不再恢复 QP
+  bool transfer_ok; // finished 之后有效，是否按顺序收全了所有 chunk
+  bool client_done; // client 已经拿到最终结果，可以释放 RDMA 资源
+
+  int PostAllRecvs() {
+    posted_recvs = 0;
+    for (int i = 0; i < kRdmaQueueSize; i++) {
+      if (RdmaPostRecv(kBufferSize, mr->lkey, i, qp, buf + i * kBufferSize) !=
+          0) {
+        fprintf(stderr, "ERROR: post recv %d failed\n", i);
+        return -1;
+      }
+      posted_recvs++;
+    }
+    return 0;
+  }
+
+  // 处理一个 recv CQE，成功时重新 post 这个 buffer
+  void HandleRecvWc(const ibv_wc &wc, bool repost) {
+    posted_recvs--;
+    if (wc.status != IBV_WC_SUCCESS) {
+      if (!qp_broken) {
+        fprintf(stderr, "ERROR: wc status %s, wait for recovery\n",
+                ibv_wc_status_str(wc.status));
+      }
+      qp_broken = true;
+      return;
+    }
+    if (wc.opcode != IBV_WC_RECV) {
+      fprintf(stderr, "ERROR: wc opcode %d\n", wc.opcode);
+      return;
+    }
+    if (wc.imm_data != static_cast<uint32_t>(recv_cnt)) {
+      fprintf(stderr, "ERROR: expect chunk %d, got %u\n", recv_cnt,
+              wc.imm_data);
+      chunk_lost = true;
+      return;
+    }
+    recv_cnt++;
+    if (repost) {
+      if (RdmaPostRecv(kBufferSize, mr->lkey, wc.wr_id, qp,
+                       buf + wc.wr_id * kBufferSize) != 0) {
+        fprintf(stderr, "ERROR: repost recv %lu failed, wait for recovery\n",
+                wc.wr_id);
+        // 否则 client 会一直 RNR 重试下去，永远等不到错误
+        RdmaModifyQp2Error(qp);
+        qp_broken = true;
+        return;
+      }
+      posted_recvs++;
+    }
+  }
+
+  // 在主循环线程里执行：取干净 CQ，QP 经 RESET 重新到 RTS。
+  // remote_info.psn 已经由 jrpc 线程填好，失败返回 -1
+  int Recover();
 
   void BuildRdmaEnvironment(const string &dev_name) {
     // 1. dev_info and pd
@@ -57,6 +136,16 @@ struct ServerContext {
       exit(0);
     }
     qp = nullptr;
+    recv_cnt = 0;
+    posted_recvs = 0;
+    qp_broken = false;
+    chunk_lost = false;
+    qp_ready = false;
+    recover_requested = false;
+    recover_ok = false;
+    finished = false;
+    transfer_ok = false;
+    client_done = false;
   }
 
   void DestroyRdmaEnvironment() {
@@ -72,6 +161,51 @@ struct ServerContext {
   }
 } s_ctx;
 
+int64_t GetUs() {
+  timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_usec + tv.tv_sec * 1000000L;
+}
+
+int ServerContext::Recover() {
+  int64_t start_us = GetUs();
+
+  // 1. 已经到达的 chunk 照常计数，剩下的 recv WR 全部刷出
+  qp_broken = true;
+  if (RdmaModifyQp2Error(qp) != 0) {
+    return -1;
+  }
+  ibv_wc drain_wc[kPollCqSize];
+  while (posted_recvs > 0) {
+    int n = ibv_poll_cq(cq, kPollCqSize, drain_wc);
+    if (n < 0) {
+      fprintf(stderr, "ERROR: poll cq failed %d\n", n);
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      HandleRecvWc(drain_wc[i], false);
+    }
+    if (chunk_lost) {
+      return -1;
+    }
+    if (GetUs() - start_us > kDrainTimeoutUs) {
+      fprintf(stderr, "ERROR: drain cq timeout, %d recvs left\n",
+              posted_recvs);
+      return -1;
+    }
+  }
+
+  // 2. 复用 MR、CQ，换新的 PSN 重新建立连接
+  local_info.psn = RdmaGenPsn();
+  if (RdmaRecoverQp(qp, local_info, remote_info) != 0 || PostAllRecvs() != 0) {
+    return -1;
+  }
+  qp_broken = false;
+  printf("recover qp in %ld us, resume from %d\n", GetUs() - start_us,
+         recv_cnt);
+  return 0;
+}
+
 class ServerJrpcServer : public jsonrpc::AbstractServer<ServerJrpcServer> {
 public:
   explicit ServerJrpcServer(jsonrpc::TcpSocketServer &server)
@@ -79,48 +213,110 @@ public:
     this->bindAndAddMethod(
         Procedure("ExchangeQP", PARAMS_BY_NAME, JSON_STRING, nullptr),
         &ServerJrpcServer::ExchangeQP);
+    this->bindAndAddMethod(
+        Procedure("RecoverQP", PARAMS_BY_NAME, JSON_STRING, nullptr),
+        &ServerJrpcServer::RecoverQP);
+    this->bindAndAddMethod(
+        Procedure("FinishQP", PARAMS_BY_NAME, JSON_STRING, nullptr),
+        &ServerJrpcServer::FinishQP);
   }
 
   void ExchangeQP(const Json::Value &req, Json::Value &resp) { // NOLINT
     if (s_ctx.qp != nullptr) {
       cerr << "qp already inited" << endl;
     }
+    s_ctx.start_cpu_us = GetProcessCpuUs();
     s_ctx.qp = RdmaCreateQp(s_ctx.dev_info.pd, s_ctx.cq, s_ctx.cq,
                             kRdmaQueueSize, IBV_QPT_RC);
     if (s_ctx.qp == nullptr) {
       cerr << "create qp failed" << endl;
       exit(0);
     }
-    RdmaQpExchangeInfo local_info;
+    RdmaQpExchangeInfo &local_info = s_ctx.local_info;
     local_info.lid = s_ctx.dev_info.port_attr.lid;
     local_info.qpNum = s_ctx.qp->qp_num;
-    ibv_query_gid(s_ctx.dev_info.ctx, kRdmaDefaultPort, kGidIndex,
+    local_info.gid_index = RdmaGetGidIndex();
+    ibv_query_gid(s_ctx.dev_info.ctx, kRdmaDefaultPort, local_info.gid_index,
                   &local_info.gid);
-    local_info.gid_index = kGidIndex;
+    local_info.psn = RdmaGenPsn();
     printf("local lid %d qp_num %d gid %s gid_index %d\n", local_info.lid,
            local_info.qpNum, RdmaGid2Str(local_info.gid).c_str(),
            local_info.gid_index);
 
-    RdmaQpExchangeInfo remote_info = {
-        .lid = static_cast<uint16_t>(req["lid"].asUInt()),
-        .qpNum = req["qp_num"].asUInt(),
-        .gid = RdmaStr2Gid(req["gid"].asString()),
-        .gid_index = req["gid_index"].asInt()};
+    RdmaQpExchangeInfo &remote_info = s_ctx.remote_info;
+    remote_info = {.lid = static_cast<uint16_t>(req["lid"].asUInt()),
+                   .qpNum = req["qp_num"].asUInt(),
+                   .gid = RdmaStr2Gid(req["gid"].asString()),
+                   .gid_index = req["gid_index"].asInt(),
+                   .psn = req["psn"].asUInt()};
     printf("remote lid %d qp_num %d gid %s gid_index %d\n", local_info.lid,
            local_info.qpNum, RdmaGid2Str(local_info.gid).c_str(),
            local_info.gid_index);
 
-    RdmaModifyQp2Rts(s_ctx.qp, local_info, remote_info);
-
-    for (int i = 0; i < kRdmaQueueSize; i++) {
-      RdmaPostRecv(kBufferSize, s_ctx.mr->lkey, i, s_ctx.qp,
-                   s_ctx.buf + i * kBufferSize);
+    if (RdmaModifyQp2Rts(s_ctx.qp, local_info, remote_info) != 0 ||
+        s_ctx.PostAllRecvs() != 0) {
+      cerr << "setup qp failed" << endl;
+      exit(1);
     }
+    s_ctx.qp_ready.store(true, std::memory_order_release);
 
     resp["lid"] = local_info.lid;
     resp["qp_num"] = local_info.qpNum;
     resp["gid"] = RdmaGid2Str(local_info.gid);
     resp["gid_index"] = local_info.gid_index;
+    resp["psn"] = local_info.psn;
+  }
+
+  // client 发现 QP 出错后调用：交给主循环取干净 CQ，QP 经 RESET 重新到
+  // RTS，交换新的 PSN，返回已按顺序收到的 chunk 数作为续传起点。
+  // 主循环已经收完所有 chunk 退出时直接返回 recv_cnt，client 据此结束
+  void RecoverQP(const Json::Value &req, Json::Value &resp) { // NOLINT
+    std::unique_lock<std::mutex> lock(s_ctx.mu);
+    if (!s_ctx.finished) {
+      if (!s_ctx.qp_ready.load(std::memory_order_acquire)) {
+        cerr << "qp not inited" << endl;
+        resp["ok"] = false;
+        return;
+      }
+      s_ctx.remote_info.psn = req["psn"].asUInt();
+      s_ctx.recover_requested.store(true, std::memory_order_release);
+      s_ctx.cv.wait(lock, [] {
+        return !s_ctx.recover_requested.load(std::memory_order_acquire) ||
+               s_ctx.finished;
+      });
+    }
+    if (s_ctx.finished) {
+      // 收完了就不再恢复，transfer_ok 为 false 说明主循环出错退出了
+      resp["ok"] = s_ctx.transfer_ok;
+      resp["recv_cnt"] = s_ctx.recv_cnt;
+      s_ctx.client_done = true;
+      s_ctx.cv.notify_all();
+      return;
+    }
+    printf("client acked %u, resume from %d\n", req["acked"].asUInt(),
+           s_ctx.recv_cnt);
+    resp["ok"] = s_ctx.recover_ok;
+    resp["psn"] = s_ctx.local_info.psn;
+    resp["recv_cnt"] = s_ctx.recv_cnt;
+    if (!s_ctx.recover_ok) {
+      // 主循环恢复失败后会退出，client 也会据此结束
+      s_ctx.client_done = true;
+      s_ctx.cv.notify_all();
+    }
+  }
+
+  // client 收到所有发送完成后调用：等主循环收完，返回是否按顺序收全。
+  // 在这之前 server 不会释放 QP，尾部出错的 RecoverQP 仍然能得到应答
+  void FinishQP(const Json::Value & /*req*/, Json::Value &resp) { // NOLINT
+    std::unique_lock<std::mutex> lock(s_ctx.mu);
+    s_ctx.cv.wait_for(lock, std::chrono::microseconds(kFinishTimeoutUs),
+                      [] { return s_ctx.finished; });
+    resp["ok"] = s_ctx.finished && s_ctx.transfer_ok;
+    resp["recv_cnt"] = s_ctx.recv_cnt;
+    if (s_ctx.finished) {
+      s_ctx.client_done = true;
+      s_ctx.cv.notify_all();
+    }
   }
 };
 
@@ -128,12 +324,6 @@ ServerJrpcServer *jrpc_server = nullptr;
 
 ibv_wc wc[kPollCqSize];
 
-int64_t GetUs() {
-  timeval tv;
-  gettimeofday(&tv, nullptr);
-  return tv.tv_usec + tv.tv_sec * 1000000L;
-}
-
 int main(int argc, char *argv[]) {
   if (argc != 3) {
     printf("Usage: %s <dev_name> <port>\n", argv[0]);
@@ -142,32 +332,68 @@ int main(int argc, char *argv[]) {
   string dev_name = argv[1];
   int port = atoi(argv[2]);
 
+  srand48(GetUs() ^ getpid());
   s_ctx.BuildRdmaEnvironment(dev_name);
 
   jsonrpc::TcpSocketServer server("0.0.0.0", port);
   jrpc_server = new ServerJrpcServer(server);
   jrpc_server->StartListening();
   printf("server start listening...\n");
+  fflush(stdout); // bench/run_bench.py 等这一行出现后再启动 client
 
-  int recv_cnt = 0;
-  while (recv_cnt < kSendTaskNum) {
+  while (!s_ctx.qp_ready.load(std::memory_order_acquire)) {
+  }
+  bool failed = false;
+  while (s_ctx.recv_cnt < static_cast<int>(kSendTaskNum)) {
+    if (s_ctx.recover_requested.load(std::memory_order_acquire)) {
+      int ret = s_ctx.Recover();
+      {
+        std::lock_guard<std::mutex> lock(s_ctx.mu);
+        s_ctx.recover_ok = ret == 0;
+        s_ctx.recover_requested.store(false, std::memory_order_release);
+      }
+      s_ctx.cv.notify_all();
+      if (ret != 0) {
+        cerr << "recover qp failed" << endl;
+        failed = true;
+        break;
+      }
+      continue;
+    }
     int n = ibv_poll_cq(s_ctx.cq, kPollCqSize, wc);
     for (int i = 0; i < n; i++) {
-      if (wc[i].status == IBV_WC_SUCCESS) {
-        if (wc[i].opcode == IBV_WC_RECV) {
-          recv_cnt++;
-          RdmaPostRecv(kBufferSize, s_ctx.mr->lkey, wc[i].wr_id, s_ctx.qp,
-                       s_ctx.buf + wc[i].wr_id * kBufferSize);
-        } else {
-          fprintf(stderr, "ERROR: wc[i] opcode %d", wc[i].opcode);
-        }
-      } else {
-        fprintf(stderr, "ERROR: wc[i] status %d", wc[i].status);
-      }
+      // QP 出错后不再 post recv，剩下的 CQE 留给 Recover 取
+      s_ctx.HandleRecvWc(wc[i], !s_ctx.qp_broken);
+    }
+    if (s_ctx.chunk_lost) {
+      failed = true;
+      break;
     }
   }
 
-  s_ctx.DestroyRdmaEnvironment();
+  {
+    std::lock_guard<std::mutex> lock(s_ctx.mu);
+    s_ctx.finished = true;
+    s_ctx.transfer_ok = !failed;
+  }
+  s_ctx.cv.notify_all();
 
-  return 0;
-}
\ No newline at end of file
+  if (!failed) {
+    // 只统计从 ExchangeQP 到收完的 CPU 时间，bench/run_bench.py 解析这一行
+    printf("messages: %d, cpu %ld us\n", s_ctx.recv_cnt,
+           GetProcessCpuUs() - s_ctx.start_cpu_us);
+  }
+
+  {
+    // 等 client 通过 FinishQP 或 RecoverQP 拿到结果，再持锁释放资源
+    std::unique_lock<std::mutex> lock(s_ctx.mu);
+    if (!s_ctx.cv.wait_for(lock, std::chrono::microseconds(kFinishTimeoutUs),
+                           [] { return s_ctx.client_done; })) {
+      cerr << "client did not confirm the result" << endl;
+      failed = true;
+    }
+    s_ctx.DestroyRdmaEnvironment();
+  }
+
+  return failed ? 1 : 0;
+}